@@ -26,6 +26,10 @@
 #include <string.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <dirent.h>
+#include <poll.h>
+#include <syslog.h>
+#include <sys/stat.h>
 #include <sys/time.h>
 
 
@@ -38,10 +42,13 @@
 struct OpenFile {
    CameraFile *file;
    unsigned long count;
+   int fd;	/* disk passthrough only, -1 otherwise */
+   off_t readpos;	/* next offset of a sequential reader, -1 if not */
 
    void *buf;
    unsigned long size;
    int writing;
+   int dirty;	/* written to since the last upload */
    gchar *destdir;
    gchar *destname;
 };
@@ -52,6 +59,8 @@ freeOpenFile(OpenFile *openFile)
 {
    if (openFile->file)
       gp_file_unref(openFile->file);
+   if (openFile->fd >= 0)
+      close(openFile->fd);
    g_free(openFile);
 }
 
@@ -121,6 +130,8 @@ gpresultToErrno(int result)
         return -EPERM;
     case GP_ERROR_OS_FAILURE:
         return -EPIPE;
+    case GP_ERROR_NO_SPACE:
+        return -ENOSPC;
     }
     return -EINVAL;
 }
@@ -131,11 +142,49 @@ struct GPCtx {
    CameraAbilitiesList *abilities;
    int debug_func_id;
 
+   /*
+    * For disk: ports this is a descriptor on the mounted directory,
+    * and getattr/readdir/read bypass libgphoto2. -1 otherwise.
+    */
+   int diskfd;
+
+   /*
+    * lock guards the tables below and is held for the whole of each
+    * FUSE operation. camlock serialises libgphoto2 calls, which the
+    * prefetch thread makes too; see cameraLock().
+    */
+   GMutex lock;
+   GMutex camlock;
+   int camheld;
+
    gchar *directory;
    GHashTable *files;
    GHashTable *dirs;
    GHashTable *reads;
    GHashTable *writes;
+
+   /* Last known storage state, see checkSpace(). */
+   CameraStorageInformation *storages;
+   int nrofstorages;
+
+   /* Cross-file prefetch, see prefetchNext(). */
+   GHashTable *listings;
+   GHashTable *prefetched;
+   GAsyncQueue *prefetchq;
+   GThread *prefetcher;
+   int prefetchstop;
+   gchar *lastcomplete;	/* last file read front to back */
+
+   /* Memory pressure handling, see pressureThread(). */
+   gchar *pressurefile;
+   gchar *memhighfile;
+   gchar *memcurrentfile;
+   GThread *pressurewatcher;
+   int pressurewake[2];
+   int pressurelevel;
+   gulong evictedPrefetched;
+   gulong evictedBuffers;
+   gulong evictedHeaders;
 };
 typedef struct GPCtx GPCtx;
 
@@ -147,19 +196,176 @@ static gchar *sPort = NULL;
 static gchar *sModel = NULL;
 static gchar *sUsbid = NULL;
 static gint sSpeed = 0;
+static gint sPrefetch = 1;
+static gint sPrefetchMax = 64;
 static gboolean sHelp = FALSE;
 
 static struct timeval glob_tv_zero;
 
+/* Pushed onto the prefetch queue to stop the prefetch thread. */
+static gchar sPrefetchStop[] = "";
+
 static GPCtx *sGPGlobalCtx = NULL;
 
 
+/*
+ * Camera locking.
+ *
+ * FUSE operations take the camera lock on their first libgphoto2 call
+ * and keep it until the operation returns. While waiting for it they
+ * let go of the table lock, so that operations and threads that only
+ * need the tables are not held up by a long prefetch download. Table
+ * pointers looked up before cameraLock() must be looked up again.
+ *
+ * The transfers themselves (listing, reading and uploading files) run
+ * between tablesRelease() and tablesRetake(), so that the pressure
+ * thread can shed caches meanwhile. The same rule about table pointers
+ * applies after them.
+ */
+
+static void
+tablesRelease(GPCtx *p)
+{
+   g_mutex_unlock(&p->lock);
+}
+
+static void
+tablesRetake(GPCtx *p)
+{
+   g_mutex_lock(&p->lock);
+}
+
+static void
+cameraLock(GPCtx *p)
+{
+   if (p->camheld)
+      return;
+   if (!g_mutex_trylock(&p->camlock)) {
+      g_mutex_unlock(&p->lock);
+      g_mutex_lock(&p->camlock);
+      g_mutex_lock(&p->lock);
+   }
+   p->camheld = 1;
+}
+
+static gboolean
+cameraTryLock(GPCtx *p)
+{
+   if (!p->camheld && g_mutex_trylock(&p->camlock))
+      p->camheld = 1;
+   return p->camheld;
+}
+
+static void
+cameraUnlock(GPCtx *p)
+{
+   if (p->camheld) {
+      p->camheld = 0;
+      g_mutex_unlock(&p->camlock);
+   }
+}
+
+
 /*
  * Function definitions
  */
 
 static int gphotofs_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi);
 
+/*
+ * Disk passthrough helpers.
+ *
+ * A disk: port is served by the directory camlib, which is only a view
+ * on a local directory. We serve getattr/readdir/read from that
+ * directory ourselves, filling in the same attributes and hiding the
+ * same dot entries the camlib would.
+ */
+
+static const char *
+diskPath(const char *path)
+{
+   while (*path == '/')
+      path++;
+   return *path ? path : ".";
+}
+
+static int
+diskHidden(const char *path)
+{
+   return strstr(path, "/.") != NULL;
+}
+
+static int
+diskFillStat(int dirfd, const char *name, struct stat *stbuf)
+{
+   struct stat st;
+
+   if (fstatat(dirfd, name, &st, 0) == -1)
+      return -errno;
+
+   memset(stbuf, 0, sizeof(struct stat));
+   if (S_ISDIR(st.st_mode)) {
+      stbuf->st_mode = S_IFDIR | 0755;
+      /* This is not a correct number in general. */
+      stbuf->st_nlink = 2;
+   } else if (S_ISREG(st.st_mode)) {
+      stbuf->st_mode = S_IFREG;
+      if (st.st_mode & S_IWUSR)
+         stbuf->st_mode |= 0644;
+      else
+         stbuf->st_mode |= 0444;
+      stbuf->st_nlink = 1;
+      stbuf->st_size = st.st_size;
+      stbuf->st_mtime = st.st_mtime;
+      stbuf->st_blocks = (st.st_size / 512) +
+                         (st.st_size % 512 > 0 ? 1 : 0);
+   } else {
+      return -ENOENT;
+   }
+   stbuf->st_uid = getuid();
+   stbuf->st_gid = getgid();
+   return 0;
+}
+
+static int
+diskReaddir(GPCtx *p,
+            const char *path,
+            void *buf,
+            fuse_fill_dir_t filler)
+{
+   DIR *dir;
+   struct dirent *de;
+   int fd, ret;
+
+   if (diskHidden(path))
+      return -ENOENT;
+
+   fd = openat(p->diskfd, diskPath(path), O_RDONLY | O_DIRECTORY);
+   if (fd == -1)
+      return -errno;
+   dir = fdopendir(fd);
+   if (!dir) {
+      ret = -errno;
+      close(fd);
+      return ret;
+   }
+
+   filler(buf, ".", NULL, 0);
+   filler(buf, "..", NULL, 0);
+
+   while ((de = readdir(dir))) {
+      struct stat stbuf;
+
+      if (de->d_name[0] == '.')
+         continue;
+      if (diskFillStat(dirfd(dir), de->d_name, &stbuf) != 0)
+         continue;
+      filler(buf, de->d_name, &stbuf, 0);
+   }
+   closedir(dir);
+   return 0;
+}
+
 static int
 dummyfiller(void *buf, const char *name,
             const struct stat *stbuf, off_t off
@@ -176,7 +382,11 @@ gphotofs_check_events() {
     void *eventdata;
     static int ineventcheck = 0;
 
-    if (ineventcheck)
+    /*
+     * The directory camlib has no events to report, and a busy camera
+     * is asked again on the next operation.
+     */
+    if (ineventcheck || p->diskfd >= 0 || !cameraTryLock(p))
         return GP_OK;
     ineventcheck = 1;
 
@@ -212,12 +422,17 @@ gphotofs_readdir(const char *path,
 {
    GPCtx *p;
    CameraList *list = NULL;
+   GPtrArray *names = NULL;
    int i;
    int ret = 0;
 
    int event_ret = 0;
    p = (GPCtx *)fuse_get_context()->private_data;
 
+   if (p->diskfd >= 0)
+      return diskReaddir(p, path, buf, filler);
+
+   cameraLock(p);
    event_ret = gphotofs_check_events();
    if (event_ret == GP_ERROR_IO_USB_FIND || event_ret == GP_ERROR_MODEL_NOT_FOUND)
         return gpresultToErrno(event_ret);
@@ -228,7 +443,9 @@ gphotofs_readdir(const char *path,
    /* Read directories */
    gp_list_new(&list);
 
+   tablesRelease(p);
    ret = gp_camera_folder_list_folders(p->camera, path, list, p->context);
+   tablesRetake(p);
    if (ret != 0) {
       goto error;
    }
@@ -258,8 +475,11 @@ gphotofs_readdir(const char *path,
 
    /* Read files */
    gp_list_new(&list);
+   names = g_ptr_array_new_with_free_func(g_free);
 
+   tablesRelease(p);
    ret = gp_camera_folder_list_files(p->camera, path, list, p->context);
+   tablesRetake(p);
    if (ret != 0) {
       goto error;
    }
@@ -271,7 +491,10 @@ gphotofs_readdir(const char *path,
       CameraFileInfo info;
 
       gp_list_get_name(list, i, &name);
+      g_ptr_array_add(names, g_strdup(name));
+      tablesRelease(p);
       ret = gp_camera_file_get_info(p->camera, path, name, &info, p->context);
+      tablesRetake(p);
       if (ret != 0) {
          goto error;
       }
@@ -301,10 +524,17 @@ gphotofs_readdir(const char *path,
       g_hash_table_replace(p->files, key, stbuf);
    }
 
+   /* Remember the listing order for prefetchNext(). */
+   g_hash_table_replace(p->listings, g_strdup(path), names);
+   names = NULL;
+
 exit:
    if (list) {
       gp_list_free(list);
    }
+   if (names) {
+      g_ptr_array_free(names, TRUE);
+   }
    return ret;
 
  error:
@@ -336,6 +566,12 @@ gphotofs_getattr(const char *path,
       return 0;
    }
 
+   if (p->diskfd >= 0) {
+      if (diskHidden(path))
+         return -ENOENT;
+      return diskFillStat(p->diskfd, diskPath(path), stbuf);
+   }
+
    /*
     * Due to the libgphoto2 api, the best way of verifying
     * if a file exists is to iterate the contents of that
@@ -376,6 +612,169 @@ gphotofs_getattr(const char *path,
    return ret;
 }
 
+/*
+ * Cross-file prefetch.
+ *
+ * Bulk copies read the files of a folder one after another, in the
+ * order readdir returned them. When a file is opened right after its
+ * predecessor in the listing was read to its end, we queue the next
+ * sPrefetch files for the prefetch thread. It downloads them into
+ * p->prefetched while the client is still reading the current one,
+ * and gphotofs_open()/gphotofs_read() pick the downloads up. Files
+ * larger than sPrefetchMax MB are left alone.
+ */
+
+struct PrefetchWindow {
+   const gchar *dir;
+   GPtrArray *names;
+   guint first;
+   guint last;
+};
+typedef struct PrefetchWindow PrefetchWindow;
+
+static gboolean
+outsidePrefetchWindow(gpointer key, gpointer value, gpointer data)
+{
+   PrefetchWindow *w = data;
+   gchar *dir = g_path_get_dirname(key);
+   gchar *file = g_path_get_basename(key);
+   gboolean outside = TRUE;
+   guint i;
+
+   if (strcmp(dir, w->dir) == 0) {
+      for (i = w->first; i < w->last; i++) {
+         if (strcmp(file, w->names->pdata[i]) == 0) {
+            outside = FALSE;
+            break;
+         }
+      }
+   }
+   g_free(dir);
+   g_free(file);
+   return outside;
+}
+
+static void
+prefetchNext(GPCtx *p, const char *path, OpenFile *openFile)
+{
+   GPtrArray *names;
+   PrefetchWindow w;
+   gchar *prev = NULL;
+   gboolean sequential;
+   guint i;
+
+   names = g_hash_table_lookup(p->listings, openFile->destdir);
+   if (!p->prefetcher || !names || p->pressurelevel)
+      return;
+   for (i = 0; i < names->len; i++) {
+      if (strcmp(names->pdata[i], openFile->destname) == 0)
+         break;
+   }
+   if (i == names->len)
+      return;
+
+   if (i > 0)
+      prev = g_build_filename(openFile->destdir, names->pdata[i - 1], NULL);
+   sequential = prev && p->lastcomplete && strcmp(prev, p->lastcomplete) == 0;
+   g_free(prev);
+   if (!sequential)
+      return;
+
+   /* Drop whatever the client has walked past or never wanted. */
+   w.dir = openFile->destdir;
+   w.names = names;
+   w.first = i + 1;
+   w.last = MIN(names->len, i + 1 + sPrefetch);
+   g_hash_table_foreach_remove(p->prefetched, outsidePrefetchWindow, &w);
+
+   for (i = w.first; i < w.last; i++) {
+      gchar *next = g_build_filename(w.dir, names->pdata[i], NULL);
+      struct stat *stbuf = g_hash_table_lookup(p->files, next);
+
+      if (!stbuf || stbuf->st_size > (off_t)sPrefetchMax * 1024 * 1024 ||
+          g_hash_table_lookup(p->prefetched, next) ||
+          g_hash_table_lookup(p->reads, next)) {
+         g_free(next);
+         continue;
+      }
+      g_async_queue_push(p->prefetchq, next);
+   }
+}
+
+/*
+ * Called after every successful read of a camera file, to spot
+ * readers that consume the whole file front to back.
+ */
+static void
+readProgress(GPCtx *p, const char *path, OpenFile *openFile,
+             off_t offset, size_t size, size_t got)
+{
+   struct stat *stbuf;
+
+   if (!p->prefetcher || openFile->readpos != offset) {
+      openFile->readpos = -1;
+      return;
+   }
+   openFile->readpos += got;
+
+   stbuf = g_hash_table_lookup(p->files, path);
+   if (got < size || (stbuf && openFile->readpos >= stbuf->st_size)) {
+      /* Report each file only once. */
+      openFile->readpos = -1;
+      g_free(p->lastcomplete);
+      p->lastcomplete = g_strdup(path);
+   }
+}
+
+static gpointer
+prefetchThread(gpointer data)
+{
+   GPCtx *p = data;
+   gchar *path;
+
+   while ((path = g_async_queue_pop(p->prefetchq)) != sPrefetchStop) {
+      gchar *dir, *file;
+      CameraFile *cFile;
+      gboolean wanted;
+      int ret;
+
+      g_mutex_lock(&p->lock);
+      wanted = !p->prefetchstop && !p->pressurelevel &&
+               !g_hash_table_lookup(p->prefetched, path) &&
+               !g_hash_table_lookup(p->reads, path);
+      g_mutex_unlock(&p->lock);
+      if (!wanted) {
+         g_free(path);
+         continue;
+      }
+
+      /*
+       * Only the camera lock is held during the download. The result
+       * goes in before it is released, so that a reader waiting for
+       * the camera finds it.
+       */
+      dir = g_path_get_dirname(path);
+      file = g_path_get_basename(path);
+      g_mutex_lock(&p->camlock);
+      gp_file_new(&cFile);
+      ret = gp_camera_file_get(p->camera, dir, file, GP_FILE_TYPE_NORMAL,
+                               cFile, p->context);
+      g_mutex_lock(&p->lock);
+      if (ret == GP_OK && !p->pressurelevel) {
+         g_hash_table_replace(p->prefetched, path, cFile);
+         path = NULL;
+      } else {
+         gp_file_unref(cFile);
+      }
+      g_mutex_unlock(&p->lock);
+      g_mutex_unlock(&p->camlock);
+      g_free(dir);
+      g_free(file);
+      g_free(path);
+   }
+   return NULL;
+}
+
 static int
 gphotofs_open(const char *path,
               struct fuse_file_info *fi)
@@ -391,15 +790,34 @@ gphotofs_open(const char *path,
    if ((fi->flags & O_ACCMODE) == O_RDONLY) {
       openFile = g_hash_table_lookup(p->reads, path);
       if (!openFile) {
-	 gchar *dir = g_path_get_dirname(path);
-	 gchar *file = g_path_get_basename(path);
+	 gchar *dir;
+	 gchar *file;
+	 int fd = -1;
+
+	 if (p->diskfd >= 0) {
+	    if (diskHidden(path))
+	       return -ENOENT;
+	    fd = openat(p->diskfd, diskPath(path), O_RDONLY);
+	    if (fd == -1)
+	       return -errno;
+	 }
+
+	 dir = g_path_get_dirname(path);
+	 file = g_path_get_basename(path);
 
 	 openFile = g_new0(OpenFile, 1);
-	 openFile->file = NULL;
+	 openFile->file = g_hash_table_lookup(p->prefetched, path);
+	 if (openFile->file) {
+	    gp_file_ref(openFile->file);
+	    g_hash_table_remove(p->prefetched, path);
+	 }
 	 openFile->count = 1;
+	 openFile->fd = fd;
+	 openFile->readpos = 0;
 	 openFile->destdir = g_strdup(dir);
 	 openFile->destname = g_strdup(file);
 	 g_hash_table_replace(p->reads, g_strdup(path), openFile);
+	 prefetchNext(p, path, openFile);
 
 	 g_free(file);
 	 g_free(dir);
@@ -418,8 +836,11 @@ gphotofs_open(const char *path,
 	 openFile = g_new0(OpenFile, 1);
 	 openFile->file = NULL;
 	 openFile->count = 1;
+	 openFile->fd = -1;
+	 openFile->readpos = -1;
 	 openFile->size = 0;
 	 openFile->writing = 1;
+	 openFile->dirty = 1;
 	 openFile->destdir = g_strdup(dir);
 	 openFile->destname = g_strdup(file);
 
@@ -454,27 +875,55 @@ gphotofs_read(const char *path,
    /* gphotofs_check_events(); ... probably on doing small reads this will take too much time */
    openFile = g_hash_table_lookup(p->reads, path);
 
-   xsize = size;
-   ret = gp_camera_file_read(p->camera, openFile->destdir, openFile->destname, GP_FILE_TYPE_NORMAL, offset, buf, &xsize, p->context);
+   if (openFile->fd >= 0) {
+      ssize_t res = pread(openFile->fd, buf, size, offset);
 
-   if (ret == GP_OK)
-      return xsize;
-   if (ret != GP_ERROR_NOT_SUPPORTED)
-      return gpresultToErrno(ret);
-   /* gp_camera_file_read NOTSUPPORTED -> fall back to old method */
+      return res == -1 ? -errno : res;
+   }
+
+   /*
+    * Prefetched files are served from memory. A download still in
+    * flight holds the camera, so look again once we have it.
+    */
+   if (!openFile->file) {
+      cameraLock(p);
+      openFile->file = g_hash_table_lookup(p->prefetched, path);
+      if (openFile->file) {
+         gp_file_ref(openFile->file);
+         g_hash_table_remove(p->prefetched, path);
+      }
+   }
+   if (!openFile->file) {
+      xsize = size;
+      tablesRelease(p);
+      ret = gp_camera_file_read(p->camera, openFile->destdir, openFile->destname, GP_FILE_TYPE_NORMAL, offset, buf, &xsize, p->context);
+      tablesRetake(p);
+
+      if (ret == GP_OK) {
+         readProgress(p, path, openFile, offset, size, xsize);
+         return xsize;
+      }
+      if (ret != GP_ERROR_NOT_SUPPORTED)
+         return gpresultToErrno(ret);
+      /* gp_camera_file_read NOTSUPPORTED -> fall back to old method */
+   }
 
    if (!openFile->file) {
       CameraFile *cFile;
 
       gp_file_new(&cFile);
+      tablesRelease(p);
       ret = gp_camera_file_get(p->camera, openFile->destdir, openFile->destname, GP_FILE_TYPE_NORMAL,
 				    cFile, p->context);
+      tablesRetake(p);
 
       openFile->file = cFile;
    }
 
    ret = gp_file_get_data_and_size(openFile->file, &data, &dataSize);
    if (ret == GP_OK) {
+      size_t want = size;
+
       if (offset < dataSize) {
          if (offset + size > dataSize) {
             size = dataSize - offset;
@@ -484,6 +933,7 @@ gphotofs_read(const char *path,
       } else {
          ret = 0;
       }
+      readProgress(p, path, openFile, offset, want, ret);
    } else {
       ret = gpresultToErrno(ret);
    }
@@ -495,6 +945,91 @@ gphotofs_read(const char *path,
 /* ================================================================================== */
 
 
+/*
+ * Upload space accounting.
+ *
+ * Staged uploads live in memory until flush, so we check them against
+ * the free space of their storage as last reported by the camera, minus
+ * the other uploads still pending there. That way a full card is
+ * noticed before the transfer, not after it.
+ */
+
+static CameraStorageInformation *
+storageForPath(GPCtx *p, const char *path)
+{
+   CameraStorageInformation *si, *best = NULL;
+   size_t len, bestlen = 0;
+   int i;
+
+   if (p->nrofstorages == 1)
+      return p->storages;
+
+   for (i = 0; i < p->nrofstorages; i++) {
+      si = p->storages + i;
+      if (!(si->fields & GP_STORAGEINFO_BASE))
+         continue;
+      len = strlen(si->basedir);
+      while (len > 0 && si->basedir[len - 1] == '/')
+         len--;
+      if (strncmp(path, si->basedir, len) != 0 ||
+          (path[len] != '/' && path[len] != '\0'))
+         continue;
+      if (!best || len > bestlen) {
+         best = si;
+         bestlen = len;
+      }
+   }
+   return best;
+}
+
+static int
+checkSpace(GPCtx *p, const char *path)
+{
+   CameraStorageInformation *si = storageForPath(p, path);
+   GHashTableIter iter;
+   gpointer key, value;
+   guint64 pending = 0;
+
+   /* Leave it to the camera if it does not tell us. */
+   if (!si || !(si->fields & GP_STORAGEINFO_FREESPACEKBYTES))
+      return 0;
+
+   g_hash_table_iter_init(&iter, p->writes);
+   while (g_hash_table_iter_next(&iter, &key, &value)) {
+      OpenFile *openFile = value;
+
+      if (openFile->dirty && storageForPath(p, key) == si)
+         pending += openFile->size;
+   }
+   if (pending > si->freekbytes * 1024)
+      return -ENOSPC;
+   return 0;
+}
+
+static guint64
+objectSize(GPCtx *p, const char *path)
+{
+   struct stat *stbuf, st;
+
+   /* disk: ports never fill p->files, see diskReaddir(). */
+   if (p->diskfd >= 0)
+      return fstatat(p->diskfd, diskPath(path), &st, 0) == 0 ? st.st_size : 0;
+   stbuf = g_hash_table_lookup(p->files, path);
+   return stbuf ? stbuf->st_size : 0;
+}
+
+static void
+accountSpace(GPCtx *p, const char *path, guint64 used, guint64 freed)
+{
+   CameraStorageInformation *si = storageForPath(p, path);
+   guint64 usedkb = (used + 1023) / 1024;
+
+   if (!si || !(si->fields & GP_STORAGEINFO_FREESPACEKBYTES))
+      return;
+   si->freekbytes += freed / 1024;
+   si->freekbytes = si->freekbytes > usedkb ? si->freekbytes - usedkb : 0;
+}
+
 static int
 gphotofs_write(const char *path, const char *wbuf, size_t size,
                        off_t offset, struct fuse_file_info *fi)
@@ -504,8 +1039,15 @@ gphotofs_write(const char *path, const char *wbuf, size_t size,
 
    if (!openFile)
       return -1;
+   openFile->dirty = 1;
    if (offset + size > openFile->size) {
+      unsigned long oldsize = openFile->size;
+
       openFile->size = offset + size;
+      if (checkSpace(p, path) < 0) {
+         openFile->size = oldsize;
+         return -ENOSPC;
+      }
       openFile->buf = realloc (openFile->buf, openFile->size);
    }
    memcpy(openFile->buf+offset, wbuf, size);
@@ -521,6 +1063,7 @@ gphotofs_mkdir(const char *path, mode_t mode)
     gchar *file = g_path_get_basename(path);
 
     gphotofs_check_events();
+    cameraLock(p);
     ret = gp_camera_folder_make_dir(p->camera, dir, file, p->context);
     if (ret != 0) {
        ret = gpresultToErrno(ret);
@@ -552,6 +1095,7 @@ gphotofs_rmdir(const char *path)
     gchar *file = g_path_get_basename(path);
 
     gphotofs_check_events();
+    cameraLock(p);
     ret = gp_camera_folder_remove_dir(p->camera, dir, file, p->context);
     if (ret != 0) {
        ret = gpresultToErrno(ret);
@@ -574,6 +1118,7 @@ gphotofs_mknod(const char *path, mode_t mode, dev_t rdev)
    CameraFile *cfile;
 
    gphotofs_check_events();
+   cameraLock(p);
    gp_file_new (&cfile);
    data = malloc(1);
    data[0] = 'c';
@@ -596,30 +1141,60 @@ static int gphotofs_flush(const char *path, struct fuse_file_info *fi)
 {
    GPCtx *p = (GPCtx *)fuse_get_context()->private_data;
    OpenFile *openFile = g_hash_table_lookup(p->writes, path);
+   CameraFile *file;
+   char *data;
+   struct stat *stbuf;
+   guint64 freed;
+   int res;
 
-    gphotofs_check_events();
-   if (!openFile)
+   if (!openFile || !openFile->writing || !openFile->dirty)
       return 0;
-   if (openFile->writing) {
-      int res;
-      CameraFile *file;
-      char *data;
-      gp_file_new (&file);
-      data = malloc (openFile->size);
-      if (!data)
-	 return -ENOMEM;
-      memcpy (data, openFile->buf, openFile->size);
-      /* The call below takes over responsbility of freeing data. */
-      res = gp_file_set_data_and_size (file, data, openFile->size);
-      if (res < 0) {
-	 gp_file_unref (file);
-	 return -1;
-      }
-      res = gp_camera_file_delete(p->camera, openFile->destdir, openFile->destname, p->context);
-      res = gp_camera_folder_put_file (p->camera, openFile->destdir, openFile->destname, GP_FILE_TYPE_NORMAL, file, p->context);
-      if (res < 0)
-	 return -ENOSPC;
+   /* Uploads that cannot fit are refused before any USB traffic. */
+   res = checkSpace(p, path);
+   if (res < 0)
+      return res;
+
+   gphotofs_check_events();
+   gp_file_new (&file);
+   data = malloc (openFile->size);
+   if (!data) {
+      gp_file_unref (file);
+      return -ENOMEM;
+   }
+   memcpy (data, openFile->buf, openFile->size);
+   /* The call below takes over responsbility of freeing data. */
+   res = gp_file_set_data_and_size (file, data, openFile->size);
+   if (res < 0) {
       gp_file_unref (file);
+      return -1;
+   }
+   g_hash_table_remove(p->prefetched, path);
+   cameraLock(p);
+   /*
+    * libgphoto2 names objects by path only and cannot rename them, so
+    * the old object (or the placeholder from gphotofs_mknod()) has to
+    * go before the new one is stored; PTP would keep both otherwise.
+    */
+   freed = objectSize(p, path);
+   if (gp_camera_file_delete(p->camera, openFile->destdir, openFile->destname, p->context) != GP_OK)
+      freed = 0;
+   tablesRelease(p);
+   res = gp_camera_folder_put_file (p->camera, openFile->destdir, openFile->destname, GP_FILE_TYPE_NORMAL, file, p->context);
+   tablesRetake(p);
+   gp_file_unref (file);
+   accountSpace(p, path, 0, freed);
+   if (res < 0) {
+      g_hash_table_remove(p->files, path);
+      return gpresultToErrno(res);
+   }
+
+   openFile->dirty = 0;
+   accountSpace(p, path, openFile->size, 0);
+   stbuf = g_hash_table_lookup(p->files, path);
+   if (stbuf) {
+      stbuf->st_size = openFile->size;
+      stbuf->st_blocks = (openFile->size / 512) +
+                         (openFile->size % 512 > 0 ? 1 : 0);
    }
    return 0;
 }
@@ -655,6 +1230,7 @@ static int gphotofs_statfs(const char *path, struct statvfs *stvfs)
     if (ret == GP_ERROR_IO_USB_FIND || ret == GP_ERROR_MODEL_NOT_FOUND)
         return gpresultToErrno(ret);
 
+    cameraLock(p);
     ret = gp_camera_get_storageinfo (p->camera, &sifs, &nrofsifs, p->context);
     if (ret < GP_OK)
         return gpresultToErrno(ret);
@@ -672,8 +1248,9 @@ static int gphotofs_statfs(const char *path, struct statvfs *stvfs)
         stvfs->f_bfree += si->freekbytes;
         stvfs->f_bavail += si->freekbytes;
     }
-    if (sifs)
-        free(sifs);
+    free(p->storages);
+    p->storages = sifs;
+    p->nrofstorages = nrofsifs;
     return 0;
 }
 
@@ -707,6 +1284,7 @@ gphotofs_unlink(const char *path)
    GPCtx *p = (GPCtx *)fuse_get_context()->private_data;
    gchar *dir = g_path_get_dirname(path);
    gchar *file = g_path_get_basename(path);
+   guint64 freed;
    int ret = 0;
 
    gphotofs_check_events();
@@ -716,13 +1294,17 @@ gphotofs_unlink(const char *path)
       goto exit;
    }
 
+   cameraLock(p);
+   freed = objectSize(p, path);
    ret = gp_camera_file_delete(p->camera, dir, file, p->context);
    if (ret != 0) {
       ret = gpresultToErrno(ret);
       goto exit;
    }
 
+   accountSpace(p, path, 0, freed);
    g_hash_table_remove(p->files, path);
+   g_hash_table_remove(p->prefetched, path);
  exit:
    g_free(dir);
    g_free(file);
@@ -731,6 +1313,298 @@ gphotofs_unlink(const char *path)
 
 }
 
+/*
+ * Memory pressure.
+ *
+ * A thread of its own watches the PSI memory stall figures of our
+ * cgroup (or of the whole system) and the cgroup memory.high limit,
+ * once a second and whenever a PSI trigger fires. While the high mark
+ * is exceeded, each check gives back one more level of cache:
+ * prefetched files first, then the full-file buffers of open files,
+ * then the attribute and listing caches. Everything can be fetched from
+ * the camera again. Only once the low mark is reached again does
+ * prefetching resume and the next episode start at the first level.
+ */
+
+/* 10% stall time in a 2 s window, which unprivileged users may set. */
+static const char sPressureTrigger[] = "some 200000 2000000";
+
+static void
+pressureInit(GPCtx *p)
+{
+   gchar *contents = NULL;
+   gchar *cgroup = NULL;
+   gchar *line;
+
+   /* cgroup v2 has a single "0::/path" line. */
+   if (g_file_get_contents("/proc/self/cgroup", &contents, NULL, NULL)) {
+      line = strstr(contents, "0::");
+      if (line) {
+         line += 3;
+         line[strcspn(line, "\n")] = '\0';
+         cgroup = g_build_filename("/sys/fs/cgroup", line, NULL);
+      }
+      g_free(contents);
+   }
+
+   if (cgroup) {
+      p->pressurefile = g_build_filename(cgroup, "memory.pressure", NULL);
+      if (access(p->pressurefile, R_OK) == 0) {
+         p->memhighfile = g_build_filename(cgroup, "memory.high", NULL);
+         p->memcurrentfile = g_build_filename(cgroup, "memory.current", NULL);
+      } else {
+         g_free(p->pressurefile);
+         p->pressurefile = NULL;
+      }
+      g_free(cgroup);
+   }
+   if (!p->pressurefile && access("/proc/pressure/memory", R_OK) == 0)
+      p->pressurefile = g_strdup("/proc/pressure/memory");
+}
+
+static guint64
+readCounter(const gchar *file)
+{
+   gchar *contents;
+   guint64 value = 0;
+
+   /* "max" reads as 0, i.e. no limit. */
+   if (g_file_get_contents(file, &contents, NULL, NULL)) {
+      value = g_ascii_strtoull(contents, NULL, 10);
+      g_free(contents);
+   }
+   return value;
+}
+
+static gboolean
+underPressure(GPCtx *p, gdouble stall, gdouble fill)
+{
+   gchar *contents, *avg;
+   gboolean ret = FALSE;
+
+   if (g_file_get_contents(p->pressurefile, &contents, NULL, NULL)) {
+      avg = strstr(contents, "some avg10=");
+      if (avg && g_ascii_strtod(avg + strlen("some avg10="), NULL) >= stall)
+         ret = TRUE;
+      g_free(contents);
+   }
+   if (!ret && p->memhighfile) {
+      guint64 high = readCounter(p->memhighfile);
+
+      if (high && readCounter(p->memcurrentfile) >= high * fill)
+         ret = TRUE;
+   }
+   return ret;
+}
+
+static void
+dropFileBuffer(gpointer key, gpointer value, gpointer data)
+{
+   OpenFile *openFile = value;
+   GPCtx *p = data;
+
+   if (openFile->file) {
+      gp_file_unref(openFile->file);
+      openFile->file = NULL;
+      p->evictedBuffers++;
+   }
+}
+
+static void
+shrinkCaches(GPCtx *p, int level)
+{
+   const char *what = "";
+
+   switch (level) {
+   case 1:
+      p->evictedPrefetched += g_hash_table_size(p->prefetched);
+      g_hash_table_remove_all(p->prefetched);
+      what = "prefetched files";
+      break;
+   case 2:
+      /* gphotofs_read() fetches these again when needed. */
+      g_hash_table_foreach(p->reads, dropFileBuffer, p);
+      what = "file buffers";
+      break;
+   case 3:
+      p->evictedHeaders += g_hash_table_size(p->files) +
+                           g_hash_table_size(p->dirs);
+      g_hash_table_remove_all(p->files);
+      g_hash_table_remove_all(p->dirs);
+      g_hash_table_remove_all(p->listings);
+      what = "cached attributes";
+      break;
+   }
+
+   /* stderr is gone once fuse_main() has daemonized. */
+   syslog(LOG_INFO, "memory pressure, dropped %s; evicted so far: "
+          "%lu prefetched files, %lu file buffers, %lu cached attributes",
+          what, p->evictedPrefetched, p->evictedBuffers, p->evictedHeaders);
+}
+
+static gpointer
+pressureThread(gpointer data)
+{
+   GPCtx *p = data;
+   struct pollfd fds[2];
+   nfds_t nfds = 1;
+
+   fds[0].fd = p->pressurewake[0];
+   fds[0].events = POLLIN;
+   fds[1].fd = open(p->pressurefile, O_RDWR | O_NONBLOCK);
+   fds[1].events = POLLPRI;
+   if (fds[1].fd >= 0) {
+      if (write(fds[1].fd, sPressureTrigger, sizeof(sPressureTrigger)) > 0)
+         nfds = 2;
+      else
+         close(fds[1].fd);
+   }
+
+   for (;;) {
+      gboolean triggered = FALSE;
+      gboolean high, low;
+
+      if (poll(fds, nfds, 1000) < 0 && errno != EINTR)
+         break;
+      if (fds[0].revents)
+         break;
+      if (nfds == 2 && fds[1].revents & (POLLERR | POLLNVAL)) {
+         /* The trigger went away, keep polling once a second. */
+         close(fds[1].fd);
+         nfds = 1;
+      } else if (nfds == 2) {
+         triggered = (fds[1].revents & POLLPRI) != 0;
+      }
+
+      /* Enter at 10% stall or 90% of memory.high, leave below 1% and 80%. */
+      high = triggered || underPressure(p, 10.0, 0.9);
+      low = !high && !underPressure(p, 1.0, 0.8);
+
+      g_mutex_lock(&p->lock);
+      if (high && p->pressurelevel < 3)
+         shrinkCaches(p, ++p->pressurelevel);
+      else if (low)
+         p->pressurelevel = 0;
+      g_mutex_unlock(&p->lock);
+   }
+
+   if (nfds == 2)
+      close(fds[1].fd);
+   return NULL;
+}
+
+/*
+ * Locked entry points.
+ *
+ * Every operation touching the camera or the tables shared with the
+ * prefetch thread runs under p->lock, and gives back the camera lock
+ * if it took it on the way.
+ */
+
+static GPCtx *
+lockCtx(void)
+{
+   GPCtx *p = (GPCtx *)fuse_get_context()->private_data;
+
+   g_mutex_lock(&p->lock);
+   return p;
+}
+
+static int
+unlockCtx(GPCtx *p, int ret)
+{
+   cameraUnlock(p);
+   g_mutex_unlock(&p->lock);
+   return ret;
+}
+
+static int
+gphotofs_readdir_locked(const char *path, void *buf, fuse_fill_dir_t filler,
+                        off_t offset, struct fuse_file_info *fi)
+{
+   GPCtx *p = lockCtx();
+   return unlockCtx(p, gphotofs_readdir(path, buf, filler, offset, fi));
+}
+
+static int
+gphotofs_getattr_locked(const char *path, struct stat *stbuf)
+{
+   GPCtx *p = lockCtx();
+   return unlockCtx(p, gphotofs_getattr(path, stbuf));
+}
+
+static int
+gphotofs_open_locked(const char *path, struct fuse_file_info *fi)
+{
+   GPCtx *p = lockCtx();
+   return unlockCtx(p, gphotofs_open(path, fi));
+}
+
+static int
+gphotofs_read_locked(const char *path, char *buf, size_t size, off_t offset,
+                     struct fuse_file_info *fi)
+{
+   GPCtx *p = lockCtx();
+   return unlockCtx(p, gphotofs_read(path, buf, size, offset, fi));
+}
+
+static int
+gphotofs_release_locked(const char *path, struct fuse_file_info *fi)
+{
+   GPCtx *p = lockCtx();
+   return unlockCtx(p, gphotofs_release(path, fi));
+}
+
+static int
+gphotofs_unlink_locked(const char *path)
+{
+   GPCtx *p = lockCtx();
+   return unlockCtx(p, gphotofs_unlink(path));
+}
+
+static int
+gphotofs_mkdir_locked(const char *path, mode_t mode)
+{
+   GPCtx *p = lockCtx();
+   return unlockCtx(p, gphotofs_mkdir(path, mode));
+}
+
+static int
+gphotofs_rmdir_locked(const char *path)
+{
+   GPCtx *p = lockCtx();
+   return unlockCtx(p, gphotofs_rmdir(path));
+}
+
+static int
+gphotofs_mknod_locked(const char *path, mode_t mode, dev_t rdev)
+{
+   GPCtx *p = lockCtx();
+   return unlockCtx(p, gphotofs_mknod(path, mode, rdev));
+}
+
+static int
+gphotofs_flush_locked(const char *path, struct fuse_file_info *fi)
+{
+   GPCtx *p = lockCtx();
+   return unlockCtx(p, gphotofs_flush(path, fi));
+}
+
+static int
+gphotofs_fsync_locked(const char *path, int isdatasync,
+                      struct fuse_file_info *fi)
+{
+   GPCtx *p = lockCtx();
+   return unlockCtx(p, gphotofs_fsync(path, isdatasync, fi));
+}
+
+static int
+gphotofs_statfs_locked(const char *path, struct statvfs *stvfs)
+{
+   GPCtx *p = lockCtx();
+   return unlockCtx(p, gphotofs_statfs(path, stvfs));
+}
+
 #if 0
 static void
 debug_func (GPLogLevel level, const char *domain, const char *str,
@@ -759,6 +1633,7 @@ gphotofs_connect()
    int ret = GP_OK;
    GPCtx *p = g_new0(GPCtx, 1);
    sGPGlobalCtx = p;
+   p->diskfd = -1;
 
 #if 0 /* enable for debugging */
         int fd = -1;
@@ -860,6 +1735,7 @@ gphotofs_connect()
                 break;
             } else {
                 char *xpath;
+                GPPortType type;
                 ret = gp_port_info_list_get_info(il, i, &info);
                 if (ret != 0)
                     break;
@@ -871,6 +1747,11 @@ gphotofs_connect()
                 gp_port_info_get_path (info, &xpath);
                 gp_setting_set("gphoto2", "port", xpath);
 
+                /* Serve mass storage directly, see diskReaddir(). */
+                gp_port_info_get_type (info, &type);
+                if (type == GP_PORT_DISK && !strncmp(xpath, "disk:", 5))
+                    p->diskfd = open(xpath + 5, O_RDONLY | O_DIRECTORY);
+
                 gp_port_info_list_free(il);
             }
         }
@@ -885,8 +1766,9 @@ gphotofs_connect()
         if (ret < GP_OK)
             break;
 
-        if (sifs)
-            free(sifs);
+        /* Kept for upload space checks, refreshed by statfs. */
+        p->storages = sifs;
+        p->nrofstorages = nrofsifs;
 
         if (nrofsifs == 0) {
             ret = GP_ERROR_IO_USB_FIND;
@@ -932,6 +1814,21 @@ gphotofs_init()
                                      (GDestroyNotify)freeOpenFile);
     p->writes = g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
                                       (GDestroyNotify)freeOpenFile);
+    p->listings = g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
+                                        (GDestroyNotify)g_ptr_array_unref);
+    p->prefetched = g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
+                                          (GDestroyNotify)gp_file_unref);
+    g_mutex_init(&p->lock);
+    g_mutex_init(&p->camlock);
+    pressureInit(p);
+    if (p->pressurefile && pipe(p->pressurewake) == 0)
+        p->pressurewatcher = g_thread_new("pressure", pressureThread, p);
+
+    /* A local directory is read ahead by the kernel already. */
+    if (sPrefetch > 0 && p->diskfd < 0) {
+        p->prefetchq = g_async_queue_new_full(g_free);
+        p->prefetcher = g_thread_new("prefetch", prefetchThread, p);
+    }
 
    return p;
 }
@@ -945,6 +1842,39 @@ gphotofs_destroy(void *context)
 
    GPCtx *p = (GPCtx *)context;
 
+   if (p->pressurewatcher) {
+      /* The hangup on the other end wakes it up. */
+      close(p->pressurewake[1]);
+      g_thread_join(p->pressurewatcher);
+      close(p->pressurewake[0]);
+   }
+   if (p->prefetcher) {
+      gchar *path;
+
+      /* Only a download in flight is waited for. */
+      g_mutex_lock(&p->lock);
+      p->prefetchstop = 1;
+      g_mutex_unlock(&p->lock);
+      while ((path = g_async_queue_try_pop(p->prefetchq)))
+         g_free(path);
+      g_async_queue_push(p->prefetchq, sPrefetchStop);
+      g_thread_join(p->prefetcher);
+      g_async_queue_unref(p->prefetchq);
+   }
+   if (p->prefetched) {
+      g_hash_table_destroy(p->prefetched);
+   }
+   if (p->listings) {
+      g_hash_table_destroy(p->listings);
+   }
+   g_free(p->lastcomplete);
+   g_mutex_clear(&p->lock);
+   g_mutex_clear(&p->camlock);
+
+   g_free(p->pressurefile);
+   g_free(p->memhighfile);
+   g_free(p->memcurrentfile);
+
    if (p->reads) {
       g_hash_table_destroy(p->reads);
    }
@@ -955,6 +1885,10 @@ gphotofs_destroy(void *context)
       g_hash_table_destroy(p->dirs);
    }
    g_free(p->directory);
+   free(p->storages);
+   if (p->diskfd >= 0) {
+      close(p->diskfd);
+   }
 
    if (p->abilities) {
       gp_abilities_list_free(p->abilities);
@@ -971,24 +1905,24 @@ gphotofs_destroy(void *context)
 static struct fuse_operations gphotofs_oper = {
     .init	= gphotofs_init,
     .destroy	= gphotofs_destroy,
-    .readdir	= gphotofs_readdir,
-    .getattr	= gphotofs_getattr,
-    .open	= gphotofs_open,
-    .read	= gphotofs_read,
-    .release	= gphotofs_release,
-    .unlink	= gphotofs_unlink,
+    .readdir	= gphotofs_readdir_locked,
+    .getattr	= gphotofs_getattr_locked,
+    .open	= gphotofs_open_locked,
+    .read	= gphotofs_read_locked,
+    .release	= gphotofs_release_locked,
+    .unlink	= gphotofs_unlink_locked,
 
     .write	= gphotofs_write,
-    .mkdir	= gphotofs_mkdir,
-    .rmdir	= gphotofs_rmdir,
-    .mknod	= gphotofs_mknod,
-    .flush	= gphotofs_flush,
-    .fsync	= gphotofs_fsync,
+    .mkdir	= gphotofs_mkdir_locked,
+    .rmdir	= gphotofs_rmdir_locked,
+    .mknod	= gphotofs_mknod_locked,
+    .flush	= gphotofs_flush_locked,
+    .fsync	= gphotofs_fsync_locked,
 
     .chmod	= gphotofs_chmod,
     .chown	= gphotofs_chown,
 
-    .statfs	= gphotofs_statfs
+    .statfs	= gphotofs_statfs_locked
 };
 
 static GOptionEntry options[] =
@@ -996,6 +1930,8 @@ static GOptionEntry options[] =
    { "port", 0, 0, G_OPTION_ARG_STRING, &sPort, N_("Specify port device"), "path" },
    { "speed", 0, 0, G_OPTION_ARG_INT, &sSpeed, N_("Specify serial transfer speed"), "speed" },
    { "camera", 0, 0, G_OPTION_ARG_STRING, &sModel, N_("Specify camera model"), "model" },
+   { "prefetch", 0, 0, G_OPTION_ARG_INT, &sPrefetch, N_("Files to fetch ahead during sequential copies (0 disables)"), "count" },
+   { "prefetch-max", 0, 0, G_OPTION_ARG_INT, &sPrefetchMax, N_("Largest file to fetch ahead, in MB"), "size" },
    { "usbid", 0, 0, G_OPTION_ARG_STRING, &sUsbid, N_("(expert only) Override USB IDs"), "usbid" },
    { "help-fuse", 'h', 0, G_OPTION_ARG_NONE, &sHelp, N_("Show FUSE help options"), NULL },
    NULL
@@ -23,6 +23,10 @@ cp "$srcdir/gphotofs.c" "$testdir/"
 sleep 2
 ls -al "${mountpoint}"
 
+# disk: ports are served straight from the directory, check they match.
+cmp "${mountpoint}/gphotofs.c" "$testdir/gphotofs.c"
+test "$(stat -c %s "${mountpoint}/gphotofs.c")" = "$(stat -c %s "$testdir/gphotofs.c")"
+
 umount "${mountpoint}"
 
 rm -f "$testdir"/*